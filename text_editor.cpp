@@ -12,18 +12,141 @@
 #include <FL/fl_ask.H>
 #include <FL/filename.H>
 #include <FL/Fl_Flex.H>
+#include <FL/Fl_Progress.H>
+#include <FL/Fl_Box.H>
+#include <FL/Fl_Preferences.H>
+#include <FL/fl_utf8.h>
 #include <FL/Fl.H>
 #include <string>
 #include <array>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
 #include <cerrno>
 #include <cstring>
 #include <cassert>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static Fl_Text_Display::Style_Table_Entry styletable[] = {     // Style table
   { FL_BLACK, FL_TIMES_BOLD, FL_NORMAL_SIZE }, // A - Plain
   { FL_BLACK, FL_TIMES_BOLD, FL_NORMAL_SIZE, Fl_Text_Display::ATTR_BGCOLOR, FL_YELLOW }, // B - highlight search patterns.
 };
 
+// pastes at least this large are inserted chunk by chunk from an idle callback,
+// so the window keeps responding and a progress bar can be shown.
+static const size_t largePasteSize = 1024 * 1024;
+static const size_t pasteChunkSize = 256 * 1024;
+
+// the session remembers a hash of this many leading bytes of the file, together with
+// its size and mtime, to decide if the saved cursor and scroll position still apply.
+static const int sessionHashSize = 64 * 1024;
+
+// the document statistics are kept per chunk of about this many bytes,
+// so an edit or a selection only needs to count the chunks it touches.
+static const int statsChunkSize = 64 * 1024;
+
+// the undo history keeps its payloads in blocks of this size, payloads at least 
+// undoCompressSize long are compressed, and a keystroke at most undoMergeSize long
+// is merged into the previous one (an input method may insert a few characters at once).
+static const size_t undoArenaBlockSize = 256 * 1024;
+static const int undoCompressSize = 4 * 1024;
+static const int undoMergeSize = 16;
+
+// default memory budget of the undo history in MB, can be changed in the preferences.
+static const int defaultUndoBudget = 64;
+
+struct TextStats {
+    int lines;
+    int chars;
+    int words;
+
+    TextStats() : lines{ 0 }, chars{ 0 }, words{ 0 } {}
+
+    TextStats& operator+=(const TextStats& other) {
+        lines += other.lines;
+        chars += other.chars;
+        words += other.words;
+        return *this;
+    }
+
+    TextStats& operator-=(const TextStats& other) {
+        lines -= other.lines;
+        chars -= other.chars;
+        words -= other.words;
+        return *this;
+    }
+
+    TextStats operator-() const {
+        TextStats negated;
+        negated -= *this;
+        return negated;
+    }
+};
+
+static bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static int is_word_start(char c, char prev) {
+    return (!is_space(c) && is_space(prev)) ? 1 : 0;
+}
+
+// counts the newlines, the UTF-8 code points and the words of `text`, 
+// `prev` is the byte right before it, it decides if the first byte starts a word.
+static TextStats count_text(const char* text, int length, char prev) {
+    TextStats stats;
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i beforeTab = _mm_set1_epi8('\t' - 1);
+    const __m128i afterReturn = _mm_set1_epi8('\r' + 1);
+    const __m128i lastContinuation = _mm_set1_epi8((char)0xBF);
+    unsigned int prevSpace = is_space(prev) ? 1 : 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i control = _mm_and_si128(_mm_cmpgt_epi8(v, beforeTab), _mm_cmplt_epi8(v, afterReturn));
+
+        unsigned int newlineBits = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        unsigned int spaceBits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space), control));
+
+        // signed compare, continuation bytes 0x80 ~ 0xBF are the only ones not greater than 0xBF.
+        unsigned int charBits = _mm_movemask_epi8(_mm_cmpgt_epi8(v, lastContinuation));
+        unsigned int wordBits = ~spaceBits & ((spaceBits << 1) | prevSpace) & 0xFFFF;
+
+        stats.lines += std::popcount(newlineBits);
+        stats.chars += std::popcount(charBits);
+        stats.words += std::popcount(wordBits);
+        prevSpace = (spaceBits >> 15) & 1;
+    }
+
+    if (i > 0) {
+        prev = text[i - 1];
+    }
+#endif
+
+    for (; i < length; ++i) {
+        char c = text[i];
+
+        stats.lines += (c == '\n') ? 1 : 0;
+        stats.chars += ((c & 0xC0) != 0x80) ? 1 : 0;
+        stats.words += is_word_start(c, prev);
+        prev = c;
+    }
+
+    return stats;
+}
+
 struct ShortcutKey {
     std::string key;
     std::string description;
@@ -105,6 +228,890 @@ public:
 
 class TextEditor;
 
+class TextBuffer : public Fl_Text_Buffer {
+public:
+    // make sure `length` bytes can be inserted at `pos` without growing the gap again,
+    // otherwise a big insert done in many small steps reallocates the whole buffer many times.
+    void reserve(int pos, int length) {
+        if (mGapEnd - mGapStart < length) {
+            reallocate_with_gap(pos, length + mPreferredGapSize);
+        }
+    }
+
+    // the byte before `pos`, the start of the buffer counts as a space.
+    char byte_before(int pos) const {
+        return pos > 0 ? byte_at(pos - 1) : ' ';
+    }
+
+    // counts the text in [start, end) in place, without copying it out of the gap buffer.
+    TextStats stats(int start, int end, char prev) const {
+        TextStats result;
+
+        if (start < mGapStart) {
+            int pieceEnd = std::min(end, mGapStart);
+            result += count_text(mBuf + start, pieceEnd - start, prev);
+
+            if (pieceEnd == end) {
+                return result;
+            }
+
+            prev = mBuf[pieceEnd - 1];
+            start = pieceEnd;
+        }
+
+        if (start < end) {
+            result += count_text(mBuf + start + (mGapEnd - mGapStart), end - start, prev);
+        }
+
+        return result;
+    }
+};
+
+// word, line and character counts of the whole document, kept per chunk and updated from 
+// the edits reported by the modify callback, so a keystroke never rescans the buffer.
+// a word is counted at the byte that starts it, lines are counted by their newlines.
+// the counts add up, so a Fenwick tree over the chunks finds positions and sums ranges in O(log n).
+class DocumentStats {
+    struct Chunk {
+        int bytes;
+        TextStats stats;
+
+        Chunk() : bytes{ 0 } {}
+    };
+
+    std::vector<Chunk> chunks;
+    std::vector<Chunk> tree;
+    TextStats total;
+
+    // builds the Fenwick tree again, needed after chunks are added, removed or merged.
+    void rebuild() {
+        tree.assign(chunks.size() + 1, Chunk());
+
+        for (size_t i = 1; i < tree.size(); ++i) {
+            tree[i].bytes += chunks[i - 1].bytes;
+            tree[i].stats += chunks[i - 1].stats;
+
+            size_t parent = i + (i & (0 - i));
+            if (parent < tree.size()) {
+                tree[parent].bytes += tree[i].bytes;
+                tree[parent].stats += tree[i].stats;
+            }
+        }
+    }
+
+    void add(size_t index, int bytes, const TextStats& stats) {
+        chunks[index].bytes += bytes;
+        chunks[index].stats += stats;
+        total += stats;
+
+        for (size_t i = index + 1; i < tree.size(); i += i & (0 - i)) {
+            tree[i].bytes += bytes;
+            tree[i].stats += stats;
+        }
+    }
+
+    // the counts of the first `count` chunks.
+    TextStats prefix(size_t count) const {
+        TextStats sum;
+
+        for (size_t i = count; i > 0; i -= i & (0 - i)) {
+            sum += tree[i].stats;
+        }
+
+        return sum;
+    }
+
+    // finds the chunk holding `pos`, the position at the very end belongs to the last chunk.
+    size_t locate(int pos, int& chunkStart) const {
+        size_t index = 0;
+        size_t step = 1;
+        int rest = pos;
+
+        while (step * 2 < tree.size()) {
+            step *= 2;
+        }
+
+        for (; step > 0; step >>= 1) {
+            if (index + step < tree.size() && tree[index + step].bytes <= rest) {
+                index += step;
+                rest -= tree[index].bytes;
+            }
+        }
+
+        chunkStart = pos - rest;
+
+        if (index >= chunks.size() && !chunks.empty()) {
+            index = chunks.size() - 1;
+            chunkStart -= chunks[index].bytes;
+        }
+
+        return index;
+    }
+
+    // counts [start, start + bytes) from the buffer again, in pieces of statsChunkSize, 
+    // and puts them in place of the chunk at `index`.
+    void rechunk(const TextBuffer* buffer, size_t index, int start, int bytes) {
+        std::vector<Chunk> pieces;
+        char prev = buffer->byte_before(start);
+
+        for (int offset = 0; offset < bytes; offset += statsChunkSize) {
+            Chunk piece;
+            piece.bytes = std::min(statsChunkSize, bytes - offset);
+            piece.stats = buffer->stats(start + offset, start + offset + piece.bytes, prev);
+            prev = buffer->byte_at(start + offset + piece.bytes - 1);
+
+            total += piece.stats;
+            pieces.push_back(piece);
+        }
+
+        total -= chunks[index].stats;
+        chunks.erase(chunks.begin() + index);
+        chunks.insert(chunks.begin() + index, pieces.begin(), pieces.end());
+        rebuild();
+    }
+
+    // a chunk shrunk by deletions goes back into its neighbour, so the chunks don't keep getting smaller.
+    void merge_small(size_t index) {
+        if (chunks.size() < 2 || chunks[index].bytes >= statsChunkSize / 4) {
+            return;
+        }
+
+        size_t first = (index + 1 < chunks.size()) ? index : index - 1;
+        if (chunks[first].bytes + chunks[first + 1].bytes > 2 * statsChunkSize) {
+            return;
+        }
+
+        chunks[first].bytes += chunks[first + 1].bytes;
+        chunks[first].stats += chunks[first + 1].stats;
+        chunks.erase(chunks.begin() + first + 1);
+        rebuild();
+    }
+
+    void remove(int pos, int nDeleted, const char* deletedText, char before) {
+        int chunkStart;
+        size_t index = locate(pos, chunkStart);
+        int removed = 0;
+        bool emptied = false;
+
+        while (removed < nDeleted && index < chunks.size()) {
+            int oldBytes = chunks[index].bytes;
+            int sliceLength = std::min(pos + nDeleted, chunkStart + oldBytes) - (pos + removed);
+
+            if (sliceLength == oldBytes) {
+                // the whole chunk is gone, no need to count it, it's dropped below.
+                total -= chunks[index].stats;
+                chunks[index] = Chunk();
+                emptied = true;
+            }
+            else {
+                char prev = removed > 0 ? deletedText[removed - 1] : before;
+                add(index, -sliceLength, -count_text(deletedText + removed, sliceLength, prev));
+            }
+
+            removed += sliceLength;
+            chunkStart += oldBytes;
+            ++index;
+        }
+
+        if (emptied) {
+            chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [](const Chunk& c) { return c.bytes == 0; }), chunks.end());
+            rebuild();
+        }
+
+        if (!chunks.empty()) {
+            merge_small(locate(pos, chunkStart));
+        }
+    }
+
+    // returns true if the byte after the inserted text was counted again as well.
+    bool insert(const TextBuffer* buffer, int pos, int nInserted, char before) {
+        if (chunks.empty()) {
+            chunks.push_back(Chunk());
+            rebuild();
+        }
+
+        int chunkStart;
+        size_t index = locate(pos, chunkStart);
+
+        if (chunks[index].bytes + nInserted > 2 * statsChunkSize) {
+            int bytes = chunks[index].bytes + nInserted;
+            rechunk(buffer, index, chunkStart, bytes);
+            return pos + nInserted < chunkStart + bytes;
+        }
+
+        add(index, nInserted, buffer->stats(pos, pos + nInserted, before));
+        return false;
+    }
+public:
+    const TextStats& totals() const {
+        return total;
+    }
+
+    void update(const TextBuffer* buffer, int pos, int nInserted, int nDeleted, const char* deletedText) {
+        assert(buffer != nullptr);
+
+        if (nDeleted > 0 && deletedText == nullptr) {
+            // nothing to count the removed text from, count the whole buffer again.
+            chunks.clear();
+            tree.clear();
+            total = TextStats();
+            
+            if (buffer->length() > 0) {
+                insert(buffer, 0, buffer->length(), ' ');
+            }
+
+            return;
+        }
+
+        // the text before the edit is untouched, so is the byte right before it.
+        char before = buffer->byte_before(pos);
+        char oldPrev = nDeleted > 0 ? deletedText[nDeleted - 1] : before;
+        int afterPos = pos + nInserted;
+        bool afterCounted = false;
+
+        if (nDeleted > 0) {
+            remove(pos, nDeleted, deletedText, before);
+        }
+
+        if (nInserted > 0) {
+            afterCounted = insert(buffer, pos, nInserted, before);
+        }
+
+        // the byte after the edit may start a word now, or not anymore.
+        if (!afterCounted && afterPos < buffer->length()) {
+            char after = buffer->byte_at(afterPos);
+            TextStats change;
+            change.words = is_word_start(after, buffer->byte_before(afterPos)) - is_word_start(after, oldPrev);
+
+            if (change.words != 0) {
+                int chunkStart;
+                add(locate(afterPos, chunkStart), 0, change);
+            }
+        }
+    }
+
+    TextStats range(const TextBuffer* buffer, int start, int end) const {
+        assert(buffer != nullptr);
+        TextStats result;
+
+        if (start >= end || chunks.empty()) {
+            return result;
+        }
+
+        int headStart;
+        size_t first = locate(start, headStart);
+
+        // a word cut by the start of the range still counts as a word.
+        int headEnd = std::min(end, headStart + chunks[first].bytes);
+        result += buffer->stats(start, headEnd, ' ');
+
+        if (headEnd == end) {
+            return result;
+        }
+
+        // the chunks in between are summed from the tree, only the chunk holding `end` is counted.
+        int tailStart;
+        size_t last = locate(end, tailStart);
+        result += prefix(last);
+        result -= prefix(first + 1);
+
+        if (tailStart < end) {
+            result += buffer->stats(tailStart, end, buffer->byte_before(tailStart));
+        }
+
+        return result;
+    }
+};
+
+static void put_varint(std::string& out, size_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+
+    out.push_back((char)value);
+}
+
+static size_t get_varint(const unsigned char*& p) {
+    size_t value = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        value |= (size_t)(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+
+    value |= (size_t)(*p++) << shift;
+    return value;
+}
+
+// a small LZ77 compressor for the undo payloads, each token is the number of literals, 
+// the literals, then the match length - 4 and the 2 bytes offset back into the output.
+// the last token only has the literals.
+static std::string compress_text(const char* data, int length) {
+    std::string out;
+    std::vector<int> table(1 << 16, -1);
+    int anchor = 0;
+    int i = 0;
+
+    while (i + 4 <= length) {
+        unsigned int sequence;
+        memcpy(&sequence, data + i, 4);
+
+        unsigned int hash = (sequence * 2654435761u) >> 16;
+        int candidate = table[hash];
+        table[hash] = i;
+
+        if (candidate < 0 || i - candidate > 0xFFFF || memcmp(data + candidate, data + i, 4) != 0) {
+            ++i;
+            continue;
+        }
+
+        int matchLength = 4;
+        while (i + matchLength < length && data[candidate + matchLength] == data[i + matchLength]) {
+            ++matchLength;
+        }
+
+        put_varint(out, i - anchor);
+        out.append(data + anchor, i - anchor);
+        put_varint(out, matchLength - 4);
+        out.push_back((char)((i - candidate) & 0xFF));
+        out.push_back((char)((i - candidate) >> 8));
+
+        i += matchLength;
+        anchor = i;
+    }
+
+    put_varint(out, length - anchor);
+    out.append(data + anchor, length - anchor);
+    return out;
+}
+
+static std::string decompress_text(const char* data, int length) {
+    std::string out;
+    out.reserve(length);
+    const unsigned char* p = (const unsigned char*)data;
+
+    while (true) {
+        size_t literals = get_varint(p);
+        out.append((const char*)p, literals);
+        p += literals;
+
+        if ((int)out.size() >= length) {
+            break;
+        }
+
+        size_t matchLength = get_varint(p) + 4;
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+
+        // the match may overlap the bytes it produces, copy one by one.
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < matchLength; ++k) {
+            out.push_back(out[from + k]);
+        }
+    }
+
+    return out;
+}
+
+// bump allocator for the undo payloads. the history only drops its oldest steps (eviction)
+// or its newest ones (redo steps replaced by a new edit), so whole blocks are released from either end.
+class UndoArena {
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t used;
+        size_t serial;
+    };
+
+    std::deque<Block> blocks;
+    size_t nextSerial;
+    size_t reserved;
+public:
+    struct Mark {
+        size_t serial;
+        size_t used;
+    };
+
+    UndoArena() : nextSerial{ 0 }, reserved{ 0 } {}
+
+    Mark mark() const {
+        if (blocks.empty()) {
+            return Mark{ nextSerial, 0 };
+        }
+
+        return Mark{ blocks.back().serial, blocks.back().used };
+    }
+
+    const char* allocate(const char* data, size_t length) {
+        if (blocks.empty() || blocks.back().used + length > blocks.back().capacity) {
+            Block block;
+            block.capacity = std::max(undoArenaBlockSize, length);
+            block.data.reset(new char[block.capacity]);
+            block.used = 0;
+            block.serial = nextSerial++;
+
+            reserved += block.capacity;
+            blocks.push_back(std::move(block));
+        }
+
+        Block& block = blocks.back();
+        char* p = block.data.get() + block.used;
+        memcpy(p, data, length);
+        block.used += length;
+        return p;
+    }
+
+    // drops everything allocated after `m`.
+    void release_after(const Mark& m) {
+        while (!blocks.empty() && blocks.back().serial > m.serial) {
+            reserved -= blocks.back().capacity;
+            blocks.pop_back();
+        }
+
+        if (!blocks.empty() && blocks.back().serial == m.serial) {
+            blocks.back().used = m.used;
+        }
+    }
+
+    // drops the blocks filled before `m`.
+    void release_before(const Mark& m) {
+        while (!blocks.empty() && blocks.front().serial < m.serial) {
+            reserved -= blocks.front().capacity;
+            blocks.pop_front();
+        }
+    }
+
+    void clear() {
+        blocks.clear();
+        reserved = 0;
+    }
+
+    size_t size() const {
+        return reserved;
+    }
+};
+
+// our own undo/redo history, fltk's one keeps every deleted text as it is and never forgets anything.
+// a step is one or more edits, undone and redone together. the step being typed is kept aside 
+// so that the following keystrokes can be merged into it, it goes into the arena once it's finished.
+class UndoHistory {
+    struct Payload {
+        const char* data;
+        int storedLength;
+        int length;
+        bool compressed;
+    };
+
+    struct Edit {
+        int pos;
+        Payload inserted;
+        Payload deleted;
+    };
+
+    struct Step {
+        size_t firstEdit;
+        size_t editCount;
+        UndoArena::Mark mark;
+    };
+
+    struct PendingEdit {
+        int pos;
+        std::string inserted;
+        std::string deleted;
+    };
+
+    UndoArena arena;
+    std::deque<Edit> edits;
+    std::deque<Step> steps;
+    size_t droppedEdits;
+    size_t current;
+    std::vector<PendingEdit> pending;
+    size_t pendingBytes;
+    int joinPos;
+    bool lastStepDropped;
+    size_t budget;
+    int groupDepth;
+    bool applying;
+    bool recording;
+
+    Payload store(const char* text, int length) {
+        Payload payload{ nullptr, length, length, false };
+
+        if (length == 0) {
+            return payload;
+        }
+
+        if (length >= undoCompressSize) {
+            std::string packed = compress_text(text, length);
+
+            if ((int)packed.size() < length) {
+                payload.data = arena.allocate(packed.data(), packed.size());
+                payload.storedLength = (int)packed.size();
+                payload.compressed = true;
+                return payload;
+            }
+        }
+
+        payload.data = arena.allocate(text, length);
+        return payload;
+    }
+
+    static std::string load(const Payload& payload) {
+        if (payload.compressed) {
+            return decompress_text(payload.data, payload.length);
+        }
+
+        return std::string(payload.data ? payload.data : "", payload.length);
+    }
+
+    // the keystrokes kept aside are closed once they reach undoCompressSize or a newline, 
+    // so one undo takes back a sensible amount, and the text soon goes into the arena.
+    bool merge(int pos, const char* inserted, int nInserted, const char* deleted, int nDeleted) {
+        if (pending.empty() || nInserted + nDeleted > undoMergeSize) {
+            return false;
+        }
+
+        PendingEdit& last = pending.back();
+
+        if (pendingBytes + nInserted + nDeleted > (size_t)undoCompressSize) {
+            return false;
+        }
+
+        if (!last.inserted.empty() && last.inserted.back() == '\n') {
+            return false;
+        }
+
+        // typing, also the text typed over a removed selection.
+        if (nDeleted == 0 && pos == last.pos + (int)last.inserted.size()) {
+            last.inserted.append(inserted, nInserted);
+            pendingBytes += nInserted;
+            return true;
+        }
+
+        // backspace and delete, only after other deletions.
+        if (nInserted == 0 && last.inserted.empty()) {
+            if (pos + nDeleted == last.pos) {
+                last.deleted.insert(0, deleted, nDeleted);
+                last.pos = pos;
+                pendingBytes += nDeleted;
+                return true;
+            }
+
+            if (pos == last.pos) {
+                last.deleted.append(deleted, nDeleted);
+                pendingBytes += nDeleted;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void seal() {
+        if (pending.empty()) {
+            return;
+        }
+
+        open_step();
+
+        for (const PendingEdit& p : pending) {
+            append_edit(p.pos, p.inserted.data(), (int)p.inserted.size(), p.deleted.data(), (int)p.deleted.size());
+        }
+
+        const PendingEdit& last = pending.back();
+        joinPos = (last.inserted.empty() ? last.pos : -1);
+
+        pending.clear();
+        pendingBytes = 0;
+        evict();
+    }
+
+    // drops the oldest steps until the history fits in the budget. a step too big for 
+    // the budget on its own is dropped as well, the status bar tells it can't be undone.
+    void evict() {
+        while (current > 0 && memory() > budget) {
+            if (current == 1) {
+                lastStepDropped = true;
+                joinPos = -1;
+            }
+
+            for (size_t i = 0; i < steps.front().editCount; ++i) {
+                edits.pop_front();
+                ++droppedEdits;
+            }
+
+            steps.pop_front();
+            --current;
+
+            if (steps.empty()) {
+                arena.clear();
+            }
+            else {
+                arena.release_before(steps.front().mark);
+            }
+        }
+    }
+
+    // a group, or an edit too big to be a keystroke, goes straight into the arena, edit by edit,
+    // so a big paste is compressed chunk by chunk while it's inserted, and never held twice in memory.
+    void open_step() {
+        Step step;
+        step.firstEdit = droppedEdits + edits.size();
+        step.editCount = 0;
+        step.mark = arena.mark();
+
+        steps.push_back(step);
+        current = steps.size();
+        lastStepDropped = false;
+    }
+
+    void append_edit(int pos, const char* inserted, int nInserted, const char* deleted, int nDeleted) {
+        Edit edit;
+        edit.pos = pos;
+        edit.inserted = store(inserted, nInserted);
+        edit.deleted = store(deleted, nDeleted);
+
+        edits.push_back(edit);
+        ++steps.back().editCount;
+    }
+
+    void drop_redo() {
+        if (current == steps.size()) {
+            return;
+        }
+
+        const Step& first = steps[current];
+        edits.resize(first.firstEdit - droppedEdits);
+        arena.release_after(first.mark);
+        steps.resize(current);
+    }
+public:
+    UndoHistory() 
+        : droppedEdits{ 0 }, current{ 0 }, pendingBytes{ 0 }, joinPos{ -1 }, lastStepDropped{ false },
+            budget{ (size_t)defaultUndoBudget * 1024 * 1024 }, groupDepth{ 0 }, applying{ false }, recording{ true } {}
+
+    void set_budget(size_t bytes) {
+        budget = bytes;
+        evict();
+    }
+
+    size_t get_budget() const {
+        return budget;
+    }
+
+    void set_recording(bool enable) {
+        recording = enable;
+    }
+
+    // false while loading a file or applying an undo/redo, the edits are not recorded then.
+    bool wants_record() const {
+        return recording && !applying;
+    }
+
+    // the edits recorded between begin_group() and end_group() are undone as one step.
+    void begin_group() {
+        if (groupDepth++ == 0) {
+            seal();
+            drop_redo();
+            open_step();
+            joinPos = -1;
+        }
+    }
+
+    void end_group() {
+        assert(groupDepth > 0);
+
+        if (--groupDepth == 0) {
+            if (steps.back().editCount == 0) {
+                steps.pop_back();
+                current = steps.size();
+            }
+            else {
+                evict();
+            }
+        }
+    }
+
+    void record(int pos, const char* inserted, int nInserted, const char* deleted, int nDeleted) {
+        if (!wants_record()) {
+            return;
+        }
+
+        if (nDeleted > 0 && deleted == nullptr) {
+            // can't undo what we don't know about, forget the history.
+            clear();
+            return;
+        }
+
+        if (groupDepth > 0) {
+            append_edit(pos, inserted, nInserted, deleted, nDeleted);
+            return;
+        }
+
+        drop_redo();
+
+        if (merge(pos, inserted, nInserted, deleted, nDeleted)) {
+            return;
+        }
+
+        seal();
+
+        // the text typed or pasted over a removed selection is undone with the removal.
+        if (nDeleted == 0 && pos == joinPos) {
+            append_edit(pos, inserted, nInserted, deleted, nDeleted);
+            joinPos = -1;
+            evict();
+            return;
+        }
+
+        joinPos = -1;
+
+        // too big to be a keystroke, compress it and count it against the budget right away.
+        if (nInserted + nDeleted > undoMergeSize) {
+            open_step();
+            append_edit(pos, inserted, nInserted, deleted, nDeleted);
+            joinPos = (nInserted == 0 ? pos : -1);
+            evict();
+            return;
+        }
+
+        PendingEdit edit;
+        edit.pos = pos;
+        edit.inserted.assign(inserted ? inserted : "", nInserted);
+        edit.deleted.assign(deleted ? deleted : "", nDeleted);
+        pending.push_back(std::move(edit));
+        pendingBytes += nInserted + nDeleted;
+    }
+
+    bool undo(Fl_Text_Buffer* buffer, int* cursor) {
+        assert(buffer != nullptr);
+        seal();
+
+        if (current == 0) {
+            return false;
+        }
+
+        const Step& step = steps[current - 1];
+        applying = true;
+        joinPos = -1;
+
+        for (size_t i = step.editCount; i > 0; --i) {
+            const Edit& edit = edits[step.firstEdit - droppedEdits + i - 1];
+            std::string text = load(edit.deleted);
+
+            buffer->replace(edit.pos, edit.pos + edit.inserted.length, text.data(), (int)text.size());
+            *cursor = edit.pos + (int)text.size();
+        }
+
+        applying = false;
+        --current;
+        return true;
+    }
+
+    bool redo(Fl_Text_Buffer* buffer, int* cursor) {
+        assert(buffer != nullptr);
+        seal();
+
+        if (current == steps.size()) {
+            return false;
+        }
+
+        const Step& step = steps[current];
+        applying = true;
+        joinPos = -1;
+
+        for (size_t i = 0; i < step.editCount; ++i) {
+            const Edit& edit = edits[step.firstEdit - droppedEdits + i];
+            std::string text = load(edit.inserted);
+
+            buffer->replace(edit.pos, edit.pos + edit.deleted.length, text.data(), (int)text.size());
+            *cursor = edit.pos + (int)text.size();
+        }
+
+        applying = false;
+        ++current;
+        return true;
+    }
+
+    void clear() {
+        arena.clear();
+        edits.clear();
+        steps.clear();
+        droppedEdits = 0;
+        current = 0;
+        pending.clear();
+        pendingBytes = 0;
+        joinPos = -1;
+        lastStepDropped = false;
+
+        // the group being recorded goes on, in a new step.
+        if (groupDepth > 0) {
+            open_step();
+        }
+    }
+
+    // true if the last edit was too big for the memory budget, and can't be undone.
+    bool last_step_dropped() const {
+        return lastStepDropped;
+    }
+
+    size_t step_count() const {
+        return steps.size() + (pending.empty() ? 0 : 1);
+    }
+
+    size_t memory() const {
+        return arena.size() + edits.size() * sizeof(Edit) + steps.size() * sizeof(Step) + pendingBytes;
+    }
+};
+
+class Editor : public Fl_Text_Editor {
+    TextEditor* te;
+public:
+    Editor(int x, int y, int w, int h, TextEditor* _te) 
+        : Fl_Text_Editor{ x, y, w, h }, te{ _te } {}
+
+    // fltk keeps these protected, the session needs them to restore the view.
+    int top_line() const { return mTopLineNum; }
+    int horizontal_offset() const { return mHorizOffset; }
+
+    int handle(int event) override;
+};
+
+struct PasteJob {
+    std::string text;
+    size_t done;
+    int pos;
+    Fl_Text_Editor* target;
+    bool active;
+
+    PasteJob() : done{ 0 }, pos{ 0 }, target{ nullptr }, active{ false } {}
+};
+
+class PasteProgressPage : public Fl_Double_Window {
+    Fl_Progress* progress;
+public:
+    PasteProgressPage(int x, int y, const char* label) : Fl_Double_Window{ x, y, 300, 50, label } {
+        progress = new Fl_Progress(10, 10, 280, 30);
+        progress->minimum(0.0f);
+        progress->maximum(1.0f);
+        progress->selection_color(0x4876FFFF);
+
+        end();
+    }
+
+    void update(size_t done, size_t total) {
+        float ratio = (total == 0 ? 1.0f : (float)done / (float)total);
+        
+        char text[64];
+        snprintf(text, sizeof(text), "正在粘贴 %d%%", (int)(ratio * 100));
+
+        progress->value(ratio);
+        progress->copy_label(text);
+    }
+};
+
 class ReplaceDialog : public Fl_Double_Window {
     Fl_Input* findTextInput;
     Fl_Input* replaceTextInput;
@@ -161,15 +1168,21 @@ public:
 
 class TextEditor {
     friend class ReplaceDialog;
+    friend class Editor;
 
     Fl_Double_Window* window;
     Fl_Menu_Bar* menuBar;
-    Fl_Text_Editor* editor;
+    Editor* editor;
     Fl_Text_Editor* splitEditor;
-    Fl_Text_Buffer* textBuffer;
+    TextBuffer* textBuffer;
     Fl_Text_Buffer* styleBuffer;
+    Fl_Box* statusBar;
+    DocumentStats documentStats;
+    UndoHistory undoHistory;
     ShortcutKeyHelpPage* shortcutKeyHelpPage;
     ReplaceDialog* replaceDialog;
+    PasteProgressPage* pasteProgressPage;
+    PasteJob pasteJob;
     std::array<char, 512> lastFindText;
     std::string fileName;
     bool textChanged;
@@ -180,6 +1193,11 @@ class TextEditor {
         assert(param != nullptr);
         TextEditor* self = (TextEditor*)param;
 
+        // wait for the paste to finish, otherwise the pasted text would be lost silently.
+        if (self->pasteJob.active) {
+            return;
+        }
+
         if (self->textChanged) {
             int result = fl_choice("当前文件还有修改没有保存,\n是否保存?", "取消", "保存", "不要保存");
 
@@ -194,6 +1212,7 @@ class TextEditor {
             }
         }
         
+        self->save_session();
         Fl::hide_all_windows();
     }
 
@@ -201,8 +1220,13 @@ class TextEditor {
         assert(param != nullptr);
         TextEditor* self = (TextEditor*)param;
 
+        self->undoHistory.set_recording(false);
         self->textBuffer->text("");
+        self->undoHistory.set_recording(true);
+        self->undoHistory.clear();
+
         self->set_text_changed(false);
+        self->update_status_bar();
     }
 
     static void menu_file_open_callback(Fl_Widget* widget, void* param) {
@@ -302,7 +1326,16 @@ class TextEditor {
         Fl_Widget* e = Fl::focus();
 
         if (e && (e == self->editor || e == self->splitEditor)) {
-            Fl_Text_Editor::kf_undo(0, (Fl_Text_Editor*)e);
+            Fl_Text_Editor* selfEditor = (Fl_Text_Editor*)e;
+            int cursor;
+
+            if (self->undoHistory.undo(self->textBuffer, &cursor)) {
+                self->textBuffer->unselect();
+                selfEditor->insert_position(cursor);
+                selfEditor->show_insert_position();
+            }
+
+            self->update_status_bar();
         }
     }
 
@@ -312,7 +1345,16 @@ class TextEditor {
         Fl_Widget* e = Fl::focus();
 
         if (e && (e == self->editor || e == self->splitEditor)) {
-            Fl_Text_Editor::kf_redo(0, (Fl_Text_Editor*)e);
+            Fl_Text_Editor* selfEditor = (Fl_Text_Editor*)e;
+            int cursor;
+
+            if (self->undoHistory.redo(self->textBuffer, &cursor)) {
+                self->textBuffer->unselect();
+                selfEditor->insert_position(cursor);
+                selfEditor->show_insert_position();
+            }
+
+            self->update_status_bar();
         }
     }
 
@@ -523,13 +1565,100 @@ class TextEditor {
         self->shortcutKeyHelpPage->show();
     }
 
-    static void text_changed_callback(int, int n_inserted, int n_deleted, int, const char*, void* param) {
+    static void text_changed_callback(int pos, int n_inserted, int n_deleted, int, const char* deleted_text, void* param) {
+        if (param == nullptr) {
+            return;
+        }
+
+        TextEditor* self = (TextEditor*)param;
+
         if (n_inserted || n_deleted) {
-            if (param != nullptr) {
-                TextEditor* self = (TextEditor*)param;
+            self->documentStats.update(self->textBuffer, pos, n_inserted, n_deleted, deleted_text);
+
+            // only copy the inserted text out when it's going to be recorded.
+            if (self->undoHistory.wants_record()) {
+                char* inserted_text = (n_inserted > 0 ? self->textBuffer->text_range(pos, pos + n_inserted) : nullptr);
+                self->undoHistory.record(pos, inserted_text, n_inserted, deleted_text, n_deleted);
+                free(inserted_text);
+            }
+
+            // a chunked paste notifies once when it's finished, not once per chunk.
+            if (!self->pasteJob.active) {
                 self->set_text_changed(true);
             }
         }
+
+        // the selection changes are reported here too, with nothing inserted or deleted.
+        self->update_status_bar();
+    }
+
+    static void paste_idle_callback(void* param) {
+        assert(param != nullptr);
+        TextEditor* self = (TextEditor*)param;
+        PasteJob& job = self->pasteJob;
+
+        size_t total = job.text.size();
+        size_t length = std::min(pasteChunkSize, total - job.done);
+
+        // never split a UTF-8 sequence between two chunks.
+        while (length > 1 && job.done + length < total && (job.text[job.done + length] & 0xC0) == 0x80) {
+            --length;
+        }
+
+        // the paste is one undo group, so all the chunks are undone together.
+        self->textBuffer->insert(job.pos + (int)job.done, job.text.data() + job.done, (int)length);
+        job.done += length;
+        self->pasteProgressPage->update(job.done, total);
+
+        if (job.done == total) {
+            self->end_chunked_paste();
+        }
+    }
+
+    void begin_chunked_paste(Fl_Text_Editor* target, const char* text, int length) {
+        assert(text != nullptr);
+        assert(target != nullptr);
+
+        // the event text is only valid during the paste event, keep our own copy.
+        pasteJob.text.assign(text, length);
+        pasteJob.done = 0;
+        pasteJob.target = target;
+
+        undoHistory.begin_group();
+        textBuffer->remove_selection();
+        pasteJob.pos = target->insert_position();
+        textBuffer->reserve(pasteJob.pos, length);
+        pasteJob.active = true;
+
+        if (pasteProgressPage == nullptr) {
+            window->begin();
+            pasteProgressPage = new PasteProgressPage(window->w() / 2 - 150, window->h() / 2 - 25, "粘贴");
+            window->end();
+        }
+
+        pasteProgressPage->position(window->w() / 2 - 150, window->h() / 2 - 25);
+        pasteProgressPage->update(0, pasteJob.text.size());
+        pasteProgressPage->show();
+
+        // the menu items may change the buffer under our feet.
+        menuBar->deactivate();
+        Fl::add_idle(paste_idle_callback, this);
+    }
+
+    void end_chunked_paste() {
+        Fl::remove_idle(paste_idle_callback, this);
+
+        int end = pasteJob.pos + (int)pasteJob.text.size();
+        std::string().swap(pasteJob.text);
+        pasteJob.active = false;
+        undoHistory.end_group();
+
+        pasteProgressPage->hide();
+        menuBar->activate();
+
+        pasteJob.target->insert_position(end);
+        pasteJob.target->show_insert_position();
+        set_text_changed(true);
     }
 
     void build_menu_bar() {
@@ -594,7 +1723,14 @@ class TextEditor {
     }
 
     void load_file_content(const std::string& path) {
-        if (textBuffer->loadfile(path.c_str()) == 0) {
+        // loading a file can't be undone, and recording it would copy the whole file into the history.
+        undoHistory.set_recording(false);
+        int result = textBuffer->loadfile(path.c_str());
+        undoHistory.set_recording(true);
+        undoHistory.clear();
+        update_status_bar();
+
+        if (result == 0) {
             set_file_name(path);
             set_text_changed(false);
         }
@@ -604,23 +1740,174 @@ class TextEditor {
         }
     }
 
+    void update_status_bar() {
+        const TextStats& total = documentStats.totals();
+        char history[128];
+        char text[256];
+        int start;
+        int end;
+
+        if (undoHistory.last_step_dropped()) {
+            snprintf(history, sizeof(history), "撤销记录: 上次修改超出 %d MB 上限, 无法撤销", 
+                (int)(undoHistory.get_budget() / (1024 * 1024)));
+        }
+        else {
+            snprintf(history, sizeof(history), "撤销记录: %d 步 (%.1f MB)", 
+                (int)undoHistory.step_count(), undoHistory.memory() / (1024.0 * 1024.0));
+        }
+
+        if (textBuffer->selection_position(&start, &end)) {
+            TextStats selected = documentStats.range(textBuffer, start, end);
+
+            // a newline at the end of the selection closes its last line, it doesn't start a new one.
+            int selectedLines = selected.lines + (textBuffer->byte_at(end - 1) == '\n' ? 0 : 1);
+            snprintf(text, sizeof(text), "行数: %d    词数: %d    字符数: %d    已选择: %d 行, %d 词, %d 字符    %s",
+                total.lines + 1, total.words, total.chars, selectedLines, selected.words, selected.chars, history);
+        }
+        else {
+            snprintf(text, sizeof(text), "行数: %d    词数: %d    字符数: %d    %s", total.lines + 1, total.words, total.chars, history);
+        }
+
+        statusBar->copy_label(text);
+    }
+
     void build_main_editor() {
         window->begin();
 
-        textBuffer = new Fl_Text_Buffer();
+        textBuffer = new TextBuffer();
+        textBuffer->canUndo(0);
         textBuffer->add_modify_callback(text_changed_callback, this);
 
-        editor = new Fl_Text_Editor(0, menuBar->h(), window->w(), window->h() - menuBar->h());
+        const int statusBarHeight = 22;
+        editor = new Editor(0, menuBar->h(), window->w(), window->h() - menuBar->h() - statusBarHeight, this);
         editor->buffer(textBuffer);
         editor->textfont(FL_COURIER);
 
         styleBuffer = new Fl_Text_Buffer();
         editor->highlight_data(styleBuffer, styletable, sizeof(styletable) / sizeof(styletable[0]), 'A', 0, 0);
 
+        statusBar = new Fl_Box(0, window->h() - statusBarHeight, window->w(), statusBarHeight);
+        statusBar->box(FL_THIN_DOWN_BOX);
+        statusBar->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
+        update_status_bar();
+
         window->resizable(editor);
         window->end();
     }
 
+    static unsigned int hash_file_head(const char* path) {
+        assert(path != nullptr);
+
+        // FNV-1a, over the head of the file on disk, the buffer may hold unsaved 
+        // changes or a transcoded copy of it. only the head so big files are not scanned again.
+        std::vector<char> head(sessionHashSize);
+        size_t length = 0;
+        unsigned int hash = 2166136261u;
+
+        FILE* fp = fl_fopen(path, "rb");
+        if (fp != nullptr) {
+            length = fread(head.data(), 1, head.size(), fp);
+            fclose(fp);
+        }
+
+        for (size_t i = 0; i < length; ++i) {
+            hash ^= (unsigned char)head[i];
+            hash *= 16777619u;
+        }
+
+        return hash;
+    }
+
+    void load_session_settings() {
+        Fl_Preferences prefs(Fl_Preferences::USER_L, "yuanukim", "simple_text_editor");
+        Fl_Preferences session(prefs, "session");
+        int value;
+
+        session.get("lineNumber", value, initEnableLineNumber ? 1 : 0);
+        initEnableLineNumber = (value != 0);
+
+        session.get("wordWrap", value, initEnableWordWrap ? 1 : 0);
+        initEnableWordWrap = (value != 0);
+
+        session.get("findText", lastFindText.data(), "", (int)lastFindText.size());
+
+        prefs.get("undoMemoryBudget", value, defaultUndoBudget);
+        undoHistory.set_budget((size_t)std::max(value, 1) * 1024 * 1024);
+    }
+
+    void save_session() {
+        Fl_Preferences prefs(Fl_Preferences::USER_L, "yuanukim", "simple_text_editor");
+        Fl_Preferences session(prefs, "session");
+
+        const Fl_Menu_Item* lineNumberItem = menuBar->find_item("属性/显式行号");
+        const Fl_Menu_Item* wrapModeItem = menuBar->find_item("属性/自动换行");
+
+        session.set("lineNumber", (lineNumberItem && lineNumberItem->value()) ? 1 : 0);
+        session.set("wordWrap", (wrapModeItem && wrapModeItem->value()) ? 1 : 0);
+        session.set("findText", lastFindText.data());
+
+        // written back so it can be found and changed in the preferences file.
+        prefs.set("undoMemoryBudget", (int)(undoHistory.get_budget() / (1024 * 1024)));
+
+        struct stat st;
+        if (fileName.empty() || fl_stat(fileName.c_str(), &st) != 0) {
+            session.set("file", "");
+        }
+        else {
+            session.set("file", fileName.c_str());
+            session.set("fileSize", (double)st.st_size);
+            session.set("fileTime", (double)st.st_mtime);
+            session.set("fileHash", (int)hash_file_head(fileName.c_str()));
+
+            // unsaved changes are dropped, so the current view doesn't match the file on disk.
+            session.set("cursor", textChanged ? 0 : editor->insert_position());
+            session.set("topLine", textChanged ? 1 : editor->top_line());
+            session.set("horizOffset", textChanged ? 0 : editor->horizontal_offset());
+        }
+
+        prefs.flush();
+    }
+
+    void restore_session() {
+        Fl_Preferences prefs(Fl_Preferences::USER_L, "yuanukim", "simple_text_editor");
+        Fl_Preferences session(prefs, "session");
+
+        char path[FL_PATH_MAX];
+        session.get("file", path, "", (int)sizeof(path));
+
+        struct stat st;
+        if (path[0] == '\0' || fl_stat(path, &st) != 0) {
+            return;
+        }
+
+        load_file_content(path);
+        if (fileName != path) {
+            return;
+        }
+
+        double fileSize;
+        double fileTime;
+        int fileHash;
+        int cursor;
+        int topLine;
+        int horizOffset;
+
+        session.get("fileSize", fileSize, -1.0);
+        session.get("fileTime", fileTime, -1.0);
+        session.get("fileHash", fileHash, 0);
+        session.get("cursor", cursor, 0);
+        session.get("topLine", topLine, 1);
+        session.get("horizOffset", horizOffset, 0);
+
+        // the file was changed by someone else, start from the top.
+        if (fileSize != (double)st.st_size || fileTime != (double)st.st_mtime || fileHash != (int)hash_file_head(path)) {
+            return;
+        }
+
+        editor->insert_position(std::min(cursor, textBuffer->length()));
+        editor->scroll(topLine, horizOffset);
+    }
+
     void set_default_components() {
         if (initEnableLineNumber) {
             editor->linenumber_bgcolor(0xEAEAEAFF);
@@ -641,8 +1928,10 @@ public:
             splitEditor{ nullptr },
             textBuffer{ nullptr },
             styleBuffer{ nullptr },
+            statusBar{ nullptr },
             shortcutKeyHelpPage{ nullptr },
             replaceDialog{ nullptr },
+            pasteProgressPage{ nullptr },
             fileName{ "" },
             textChanged{ false },
             initEnableLineNumber{ true },
@@ -650,8 +1939,9 @@ public:
     {
         lastFindText.fill('\0');
 
-        // be careful here, we must build menu bar first, then build the editor, 
-        // then setting the on/off state of the components.
+        // be careful here, we must load the session first, then build menu bar, 
+        // then build the editor, then setting the on/off state of the components.
+        load_session_settings();
         build_menu_bar();
         build_main_editor();
         set_default_components();
@@ -659,6 +1949,7 @@ public:
 
     void show(int argc, char* argv[]) {
         window->show(argc, argv);
+        restore_session();
     }
 };
 
@@ -677,8 +1968,13 @@ void ReplaceDialog::replace_selection(const char* newText, ReplaceDialog* self)
     int end;
 
     if (self->te->textBuffer->selection_position(&start, &end)) {
+        UndoHistory& history = self->te->undoHistory;
+
+        history.begin_group();
         self->te->textBuffer->remove_selection();
         self->te->textBuffer->insert(start, newText);
+        history.end_group();
+
         self->te->textBuffer->select(start, start + (int)strlen(newText));
 
         editor->insert_position(start + (int)strlen(newText));
@@ -702,11 +1998,41 @@ void ReplaceDialog::replace_and_find_callback(Fl_Widget* widget, void* param) {
     assert(param != nullptr);
     ReplaceDialog* rd = static_cast<ReplaceDialog*>(param);
 
+    if (rd->te->pasteJob.active) {
+        return;
+    }
+
     // replace then select the next pattern.
     replace_selection(rd->replaceTextInput->value(), rd);
     rd->te->find_pattern(rd->te->lastFindText.data(), rd->te, true);
 }
 
+int Editor::handle(int event) {
+    if (te->pasteJob.active) {
+        // the buffer is being filled chunk by chunk, drop the edits until it's finished.
+        switch (event) {
+        case FL_KEYBOARD:
+        case FL_PASTE:
+        case FL_PUSH:
+        case FL_DRAG:
+        case FL_RELEASE:
+            return 1;
+        default:
+            break;
+        }
+    }
+    else if (event == FL_PASTE && Fl::event_text() != nullptr && (size_t)Fl::event_length() >= largePasteSize) {
+        te->begin_chunked_paste(this, Fl::event_text(), Fl::event_length());
+        return 1;
+    }
+    else if (event == FL_KEYBOARD && Fl::event_state(FL_COMMAND) && Fl::event_key() == 'z') {
+        // leave undo and redo to the menu shortcuts, they go through our own undo history.
+        return 0;
+    }
+
+    return Fl_Text_Editor::handle(event);
+}
+
 int main(int argc, char* argv[]) {
     TextEditor editor;
     editor.show(argc, argv);